@@ -0,0 +1,26 @@
+// Copyright 2020 David Lareau. This source code form is subject to the terms of the Mozilla Public License 2.0.
+// site bundle: a whole site folder packed in a single file (by gen_bundle.c) that naws can mmap instead of chdir into
+// layout: header, entries (sorted by path, strcmp order), nul terminated paths, then every file body starting on a page boundary
+// numbers are in host byte order, the bundle is meant to be packed on the machine that serves it
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "NAWSBDL1"
+#define BUNDLE_MAGIC_LEN 8
+
+struct bundle_header {
+  char magic[BUNDLE_MAGIC_LEN];
+  uint32_t entry_count;
+  uint32_t page_size;
+};
+
+struct bundle_entry {
+  uint64_t path_offset; // from start of bundle, relative to the site folder (e.g. "naws/404.inc")
+  uint64_t data_offset; // from start of bundle, page aligned
+  uint64_t size;
+  int64_t mtime; // seconds
+  uint64_t etag; // FNV-1a 64 of the content
+  uint32_t path_length; // without the nul
+  uint32_t hash_djb2_ext; // extension hash, as in web_server.c
+  uint32_t mode; // st_mode of the original file (for the execute bit)
+  uint32_t reserved;
+};
@@ -0,0 +1,129 @@
+// Copyright 2020 David Lareau. This source code form is subject to the terms of the Mozilla Public License 2.0.
+// gcc gen_bundle.c -o gen_bundle && ./gen_bundle demos/sanity_test sanity_test.bundle
+// packs a site folder into a single indexed file, see bundle.h
+// the bundle is written to a temporary file then renamed, so a server still mapping the old one is not disturbed
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include "bundle.h"
+
+uint32_t hash_djb2(const char * s) {
+  uint32_t hash = 5381;
+  while(*s) hash = ((hash << 5) + hash) + *s++;
+  return hash;
+}
+
+struct file {
+  char * path;
+  struct stat stat;
+};
+
+static struct file * files;
+static size_t files_size;
+static size_t files_capacity;
+// the bundle being written and the one it replaces, in case they live in the site folder
+static struct stat output_stat[2];
+static int output_stat_size;
+
+static int collect(const char * path, const struct stat * stat, int type, struct FTW * ftw) {
+  if(type != FTW_F || !S_ISREG(stat->st_mode)) return 0;
+  // don't pack the bundle into itself
+  for(int i = 0; i < output_stat_size; i++) if(stat->st_dev == output_stat[i].st_dev && stat->st_ino == output_stat[i].st_ino) return 0;
+  if(files_size == files_capacity) {
+    files_capacity = files_capacity? files_capacity * 2 : 64;
+    files = realloc(files, files_capacity * sizeof(struct file)); if(!files) { perror("realloc()"); exit(EXIT_FAILURE); }
+  }
+  if(path[0] == '.' && path[1] == '/') path += 2;
+  files[files_size].path = strdup(path); if(!files[files_size].path) { perror("strdup()"); exit(EXIT_FAILURE); }
+  files[files_size].stat = *stat;
+  files_size++;
+  return 0;
+}
+
+static int compare_files(const void * a, const void * b) {
+  return strcmp(((const struct file *)a)->path, ((const struct file *)b)->path);
+}
+
+static uint64_t align(uint64_t offset, uint64_t page_size) {
+  return (offset + page_size - 1) / page_size * page_size;
+}
+
+int main(int argc, char * argv[]) {
+  if(argc != 3) { fprintf(stderr, "usage: gen_bundle site-folder output.bundle\n"); exit(EXIT_FAILURE); }
+  const char * site = argv[1];
+  char tmp_path[strlen(argv[2]) + 5]; sprintf(tmp_path, "%s.tmp", argv[2]);
+  int output = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR); if(output == -1) { perror("open(output)"); exit(EXIT_FAILURE); }
+  if(fstat(output, &output_stat[output_stat_size++])) { perror("fstat(output)"); exit(EXIT_FAILURE); }
+  if(!stat(argv[2], &output_stat[output_stat_size])) output_stat_size++;
+  int site_dir = open(site, O_RDONLY | O_DIRECTORY | O_CLOEXEC); if(site_dir == -1) { perror("open(site)"); exit(EXIT_FAILURE); }
+  int launch_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); if(launch_dir == -1) { perror("open(.)"); exit(EXIT_FAILURE); }
+
+  // list the files (following symlinks, like the server would)
+  if(fchdir(site_dir)) { perror("fchdir(site)"); exit(EXIT_FAILURE); }
+  if(nftw(".", collect, 16, 0)) { perror("nftw()"); exit(EXIT_FAILURE); }
+  qsort(files, files_size, sizeof(struct file), compare_files);
+
+  // layout
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  struct bundle_entry * entries = calloc(files_size, sizeof(struct bundle_entry)); if(files_size && !entries) { perror("calloc()"); exit(EXIT_FAILURE); }
+  uint64_t offset = sizeof(struct bundle_header) + files_size * sizeof(struct bundle_entry);
+  for(size_t i = 0; i < files_size; i++) {
+    entries[i].path_offset = offset;
+    entries[i].path_length = strlen(files[i].path);
+    offset += entries[i].path_length + 1;
+  }
+  for(size_t i = 0; i < files_size; i++) {
+    offset = align(offset, page_size);
+    entries[i].data_offset = offset;
+    entries[i].size = files[i].stat.st_size;
+    entries[i].mtime = files[i].stat.st_mtime;
+    entries[i].mode = files[i].stat.st_mode;
+    const char * filename = strrchr(files[i].path, '/'); filename = filename? filename + 1 : files[i].path;
+    const char * ext = strrchr(filename, '.'); ext = ext? ext + 1 : "";
+    entries[i].hash_djb2_ext = hash_djb2(ext);
+    offset += entries[i].size;
+  }
+
+  // file bodies (and their etag)
+  uint8_t buffer[64 * 1024];
+  for(size_t i = 0; i < files_size; i++) {
+    int file = open(files[i].path, O_RDONLY | O_CLOEXEC); if(file == -1) { perror("open()"); fprintf(stderr, "path %s\n", files[i].path); exit(EXIT_FAILURE); }
+    uint64_t etag = UINT64_C(14695981039346656037);
+    uint64_t done = 0;
+    while(done < entries[i].size) {
+      ssize_t n = read(file, buffer, sizeof(buffer)); if(n == -1) { perror("read()"); fprintf(stderr, "path %s\n", files[i].path); exit(EXIT_FAILURE); }
+      if(n == 0) { fprintf(stderr, "%s shrank while packing\n", files[i].path); exit(EXIT_FAILURE); }
+      if(done + n > entries[i].size) n = entries[i].size - done;
+      for(ssize_t j = 0; j < n; j++) { etag ^= buffer[j]; etag *= UINT64_C(1099511628211); }
+      ssize_t written = pwrite(output, buffer, n, entries[i].data_offset + done); if(written != n) { if(written == -1) perror("pwrite()"); else fprintf(stderr, "pwrite(): couldn't write whole buffer, wrote only %zd.\n", written); exit(EXIT_FAILURE); }
+      done += n;
+    }
+    entries[i].etag = etag;
+    if(close(file)) { perror("close()"); exit(EXIT_FAILURE); }
+  }
+  if(ftruncate(output, offset)) { perror("ftruncate()"); exit(EXIT_FAILURE); }
+
+  // index
+  struct bundle_header header = { .entry_count = files_size, .page_size = page_size };
+  memcpy(header.magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+  if(pwrite(output, &header, sizeof(header), 0) != sizeof(header)) { perror("pwrite(header)"); exit(EXIT_FAILURE); }
+  if(files_size && pwrite(output, entries, files_size * sizeof(struct bundle_entry), sizeof(header)) != files_size * sizeof(struct bundle_entry)) { perror("pwrite(entries)"); exit(EXIT_FAILURE); }
+  for(size_t i = 0; i < files_size; i++) {
+    if(pwrite(output, files[i].path, entries[i].path_length + 1, entries[i].path_offset) != entries[i].path_length + 1) { perror("pwrite(path)"); exit(EXIT_FAILURE); }
+  }
+  if(fsync(output)) { perror("fsync()"); exit(EXIT_FAILURE); }
+  if(close(output)) { perror("close(output)"); exit(EXIT_FAILURE); }
+  if(fchdir(launch_dir)) { perror("fchdir(.)"); exit(EXIT_FAILURE); }
+  if(rename(tmp_path, argv[2])) { perror("rename()"); exit(EXIT_FAILURE); }
+  printf("packed %zu files from %s into %s (%" PRIu64 " bytes)\n", files_size, site, argv[2], offset);
+  return EXIT_SUCCESS;
+}
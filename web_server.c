@@ -1,12 +1,16 @@
 // Copyright 2020 David Lareau. This program is free software under the terms of the GPL-3.0-or-later.
 // gcc web_server.c $(pkg-config --libs --cflags libsodium) -lpthread && ./a.out demos/sanity_test 8888 8889
+// with tls: gcc -DNAWS_TLS web_server.c $(pkg-config --libs --cflags libsodium openssl) -lpthread && ./a.out demos/sanity_test 8888 8889 8443
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,6 +25,24 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include "bundle.h"
+#ifdef NAWS_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+// static tracing probes (USDT, header only), a nop instruction unless a tracer attaches (see trace_latency.bt)
+// every probe is naws:<name>(int worker, const char * uri, int client, int64_t value), worker is -1 until a thread picks up the client
+#if defined(__has_include) && !defined(NAWS_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, worker, uri, client, value) DTRACE_PROBE4(naws, name, (int)(worker), (const char *)(uri), (int)(client), (int64_t)(value))
+#endif
+#endif
+#ifndef PROBE
+#define PROBE(name, worker, uri, client, value) do { (void)(uri); } while(0)
+#endif
 
 // -- Utils --
 
@@ -34,28 +56,257 @@ static uint64_t get_time_ns() {
   uint64_t ns = spec.tv_nsec; ns += spec.tv_sec * UINT64_C(1000000000); return ns;
 }
 
+static uint64_t get_monotonic_ms() {
+  struct timespec spec;
+  if(clock_gettime(CLOCK_MONOTONIC, &spec)) { perror("clock_gettime"); exit(EXIT_FAILURE); }
+  return spec.tv_sec * UINT64_C(1000) + spec.tv_nsec / 1000000;
+}
+
+// -- Site --
+
+// the site is either the root folder (which we chdir into) or a bundle mapped in memory (see bundle.h and gen_bundle.c)
+static struct bundle_header * bundle; // NULL when serving a folder
+static const struct bundle_entry * bundle_entries;
+static size_t bundle_size;
+static int bundle_fd = -1;
+
+static void load_bundle(const char * path) {
+  bundle_fd = open(path, O_RDONLY | O_CLOEXEC); if(bundle_fd == -1) { perror("open(bundle)"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
+  struct stat bundle_stat; if(fstat(bundle_fd, &bundle_stat)) { perror("fstat(bundle)"); exit(EXIT_FAILURE); }
+  bundle_size = bundle_stat.st_size;
+  if(bundle_size < sizeof(struct bundle_header)) { fprintf(stderr, "%s is not a bundle\n", path); exit(EXIT_FAILURE); }
+  bundle = mmap(NULL, bundle_size, PROT_READ, MAP_SHARED, bundle_fd, 0); if(bundle == MAP_FAILED) { perror("mmap(bundle)"); exit(EXIT_FAILURE); }
+  if(memcmp(bundle->magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN)) { fprintf(stderr, "%s is not a bundle\n", path); exit(EXIT_FAILURE); }
+  if(bundle->entry_count > (bundle_size - sizeof(struct bundle_header)) / sizeof(struct bundle_entry)) { fprintf(stderr, "bundle %s is truncated\n", path); exit(EXIT_FAILURE); }
+  bundle_entries = (const struct bundle_entry *)(bundle + 1);
+  // validate once, so lookups can trust the index
+  const char * base = (const char *)bundle;
+  size_t index_end = sizeof(struct bundle_header) + bundle->entry_count * sizeof(struct bundle_entry);
+  for(uint32_t i = 0; i < bundle->entry_count; i++) {
+    const struct bundle_entry * entry = &bundle_entries[i];
+    if(entry->path_offset >= bundle_size || entry->path_length >= bundle_size - entry->path_offset || base[entry->path_offset + entry->path_length]) { fprintf(stderr, "bundle %s has a bad path at entry %u\n", path, i); exit(EXIT_FAILURE); }
+    if(entry->data_offset > bundle_size || entry->size > bundle_size - entry->data_offset) { fprintf(stderr, "bundle %s has bad data at entry %u\n", path, i); exit(EXIT_FAILURE); }
+    if(i && strcmp(base + bundle_entries[i-1].path_offset, base + entry->path_offset) >= 0) { fprintf(stderr, "bundle %s is not sorted at entry %u\n", path, i); exit(EXIT_FAILURE); }
+    if(entry->path_offset + entry->path_length + 1 > index_end) index_end = entry->path_offset + entry->path_length + 1;
+  }
+  // lookups only ever touch the index (file bodies go out with sendfile() from bundle_fd), bring it in now rather than on first requests
+  if(madvise(bundle, index_end, MADV_WILLNEED)) perror("WARNING madvise(bundle)");
+  printf("INFO serving bundle %s (%u files)\n", path, bundle->entry_count);
+}
+
+static int compare_bundle_entry(const void * path, const void * entry) {
+  return strcmp(path, (const char *)bundle + ((const struct bundle_entry *)entry)->path_offset);
+}
+
+static const struct bundle_entry * bundle_find(const char * path) {
+  return bsearch(path, bundle_entries, bundle->entry_count, sizeof(struct bundle_entry), compare_bundle_entry);
+}
+
+// an opened file of the site: a file of its own, or a slice of the bundle
+struct site_file {
+  int fd;
+  off_t offset;
+  off_t size;
+  off_t position; // for site_read()
+};
+
+static bool site_readable(const char * path) {
+  if(bundle) return bundle_find(path) != NULL;
+  return !access(path, R_OK);
+}
+
+// on failure, errno is set
+static bool site_open(const char * path, struct site_file * file) {
+  file->position = 0;
+  if(bundle) {
+    const struct bundle_entry * entry = bundle_find(path); if(!entry) { errno = ENOENT; return false; }
+    file->fd = bundle_fd;
+    file->offset = entry->data_offset;
+    file->size = entry->size;
+    return true;
+  }
+  file->fd = open(path, O_RDONLY | O_CLOEXEC); if(file->fd == -1) return false;
+  struct stat file_stat; if(fstat(file->fd, &file_stat)) { int error = errno; close(file->fd); errno = error; return false; }
+  file->offset = 0;
+  file->size = file_stat.st_size;
+  return true;
+}
+
+static int site_close(struct site_file * file) {
+  if(bundle) return 0;
+  return close(file->fd);
+}
+
+static ssize_t site_read(struct site_file * file, void * buffer, size_t length) {
+  if(length > file->size - file->position) length = file->size - file->position;
+  ssize_t n = pread(file->fd, buffer, length, file->offset + file->position); if(n > 0) file->position += n;
+  return n;
+}
+
+// the bundle fd is shared by all threads, so always send with an explicit offset
+static ssize_t site_sendfile(int socket, struct site_file * file) {
+  off_t offset = file->offset;
+  return sendfile(socket, file->fd, &offset, file->size);
+}
+
 static void load_file(const char * path, uint8_t * buffer, size_t length, bool securish) {
-  int file = open(path, O_RDONLY); if(file == -1) { perror("open()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
-  ssize_t n = read(file, buffer, length); if(n == -1) { perror("read()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
+  struct site_file file; if(!site_open(path, &file)) { perror("open()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
+  ssize_t n = site_read(&file, buffer, length); if(n == -1) { perror("read()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
   if(n != length) { fprintf(stderr, "read(%s) wasn't full length %zu but %zd\n", path, length, n); if(securish) explicit_bzero(buffer, length); exit(EXIT_FAILURE); }
-  if(close(file)) { if(securish) explicit_bzero(buffer, length); perror("close()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
+  if(site_close(&file)) { if(securish) explicit_bzero(buffer, length); perror("close()"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
 }
 
 // transform children end signal into a file descriptor (so I can use poll() with it)
-void mute_signals() {
-  sigset_t mask; sigemptyset(&mask); sigaddset(&mask, SIGCHLD);
+// same for the reload (SIGHUP), upgrade (SIGUSR2) and memory report (SIGUSR1) signals, which main() reads from the returned signalfd
+int mute_signals() {
+  sigset_t mask; sigemptyset(&mask); sigaddset(&mask, SIGCHLD); sigaddset(&mask, SIGHUP); sigaddset(&mask, SIGUSR2); sigaddset(&mask, SIGUSR1);
   if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1) { perror("sigprocmask"); exit(EXIT_FAILURE); }
+  sigdelset(&mask, SIGCHLD);
+  // a client going away (or shut down by its deadline) while we send is not a reason to die
+  if(signal(SIGPIPE, SIG_IGN) == SIG_ERR) { perror("signal(SIGPIPE)"); exit(EXIT_FAILURE); }
+  int fd = signalfd(-1, &mask, SFD_CLOEXEC); if(fd == -1) { perror("signalfd"); exit(EXIT_FAILURE); }
+  return fd;
 }
 
-int prep_server_socket(struct pollfd * sockets, size_t * sockets_size, uint16_t port, int backlog) {
-  int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); if(server == -1) { perror("socket()"); exit(EXIT_FAILURE); }
-  if(setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int))) { perror("setsockopt()"); exit(EXIT_FAILURE); }
-  if(bind(server, (const struct sockaddr *)&(struct sockaddr_in){AF_INET, htons(port), {INADDR_ANY}}, sizeof(struct sockaddr_in))) {
-    perror("bind(server)");
-    if(port < 1024) fprintf(stderr, "for privileged ports, ensure capability is set\nsudo setcap 'cap_net_bind_service=+ep' /path/to/program\n");
-    exit(EXIT_FAILURE);
+// listening sockets handed down by the previous server process on upgrade (see upgrade_server())
+#define inherited_max 4
+static int inherited_sockets[inherited_max];
+static int inherited_sockets_size;
+static int inherited_sockets_used;
+static int inherited_channel = -1;
+
+// if we were exec'd by an older server, receive its listening sockets
+void receive_inherited_sockets() {
+  const char * env = getenv("NAWS_UPGRADE_FD"); if(!env) return;
+  char * strtol_endptr;
+  inherited_channel = strtol(env, &strtol_endptr, 10); if(*strtol_endptr) { fprintf(stderr, "could not parse NAWS_UPGRADE_FD %s\n", env); exit(EXIT_FAILURE); }
+  unsetenv("NAWS_UPGRADE_FD");
+  if(fcntl(inherited_channel, F_SETFD, FD_CLOEXEC)) { perror("fcntl(upgrade channel)"); exit(EXIT_FAILURE); }
+  uint8_t count;
+  union { char buffer[CMSG_SPACE(sizeof(int) * inherited_max)]; struct cmsghdr align; } control;
+  struct iovec iov = { &count, 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+  ssize_t n = recvmsg(inherited_channel, &msg, MSG_CMSG_CLOEXEC); if(n != 1) { if(n == -1) perror("recvmsg(upgrade channel)"); else fprintf(stderr, "recvmsg(upgrade channel): no message\n"); exit(EXIT_FAILURE); }
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || count > inherited_max || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count)) { fprintf(stderr, "recvmsg(upgrade channel): unexpected message\n"); exit(EXIT_FAILURE); }
+  memcpy(inherited_sockets, CMSG_DATA(cmsg), sizeof(int) * count);
+  inherited_sockets_size = count;
+  printf("INFO inherited %d listening sockets from previous server\n", count);
+}
+
+// tell the previous server we are ready to accept, so it can stop accepting and drain
+void acknowledge_inherited_sockets() {
+  if(inherited_channel == -1) return;
+  if(inherited_sockets_used != inherited_sockets_size) { fprintf(stderr, "inherited %d listening sockets but only used %d, were the arguments changed?\n", inherited_sockets_size, inherited_sockets_used); exit(EXIT_FAILURE); }
+  ssize_t sent = send(inherited_channel, "k", 1, 0); if(sent != 1) { perror("send(upgrade channel)"); exit(EXIT_FAILURE); }
+  if(close(inherited_channel)) { perror("close(upgrade channel)"); exit(EXIT_FAILURE); }
+  inherited_channel = -1;
+}
+
+#define upgrade_timeout_s 10
+
+// exec a fresh server (from argv, so a new binary on disk is picked up) and hand it our listening sockets
+// returns true once the new server is accepting, false if it didn't make it (in which case we keep serving)
+bool upgrade_server(char * argv[], int launch_dir, struct pollfd * sockets, size_t sockets_size) {
+  int channel[2]; if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel)) { perror("socketpair(upgrade)"); return false; }
+  // everything the child needs is prepared before fork(), as other threads may hold the malloc lock at that point
+  char env[32]; snprintf(env, sizeof(env), "NAWS_UPGRADE_FD=%d", channel[1]);
+  size_t environ_size = 0; while(environ[environ_size]) environ_size++;
+  char ** envp = malloc((environ_size + 2) * sizeof(char *)); if(!envp) { perror("malloc(upgrade env)"); close(channel[0]); close(channel[1]); return false; }
+  memcpy(envp, environ, environ_size * sizeof(char *));
+  envp[environ_size] = env;
+  envp[environ_size + 1] = NULL;
+  pid_t pid = fork();
+  // child
+  if(!pid) {
+    if(fcntl(channel[1], F_SETFD, 0)) { perror("CHILD fcntl(upgrade channel)"); _exit(EXIT_FAILURE); }
+    // the new server will chdir(root) itself, relative to where we were launched
+    if(fchdir(launch_dir)) { perror("CHILD fchdir(launch dir)"); _exit(EXIT_FAILURE); }
+    sigset_t mask; sigemptyset(&mask); sigprocmask(SIG_SETMASK, &mask, NULL); signal(SIGPIPE, SIG_DFL);
+    execvpe(argv[0], argv, envp);
+    perror("CHILD execvpe(upgrade)");
+    _exit(EXIT_FAILURE);
+  }
+  // parent
+  free(envp);
+  if(close(channel[1])) perror("WARNING close(upgrade channel)");
+  if(pid == -1) { perror("fork(upgrade)"); close(channel[0]); return false; }
+  // a new server that hangs before acknowledging must not keep us from accepting
+  struct timeval timeout = { upgrade_timeout_s, 0 };
+  if(setsockopt(channel[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) perror("WARNING setsockopt(upgrade channel)");
+  uint8_t count = sockets_size;
+  int fds[inherited_max]; for(int i = 0; i < sockets_size; i++) fds[i] = sockets[i].fd;
+  union { char buffer[CMSG_SPACE(sizeof(int) * inherited_max)]; struct cmsghdr align; } control; memset(&control, 0, sizeof(control));
+  struct iovec iov = { &count, 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buffer, .msg_controllen = CMSG_SPACE(sizeof(int) * count) };
+  struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET; cmsg->cmsg_type = SCM_RIGHTS; cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+  ssize_t n = sendmsg(channel[0], &msg, 0); if(n != 1) perror("sendmsg(upgrade channel)");
+  // wait for the new server to be ready (EOF means it died, e.g. the new binary is broken)
+  char ack; if(n == 1) n = recv(channel[0], &ack, 1, 0);
+  if(close(channel[0])) perror("WARNING close(upgrade channel)");
+  if(n != 1) {
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) fprintf(stderr, "WARNING new server (pid %d) took more than %d seconds to acknowledge upgrade\n", pid, upgrade_timeout_s);
+    fprintf(stderr, "WARNING new server (pid %d) did not acknowledge upgrade, keep serving\n", pid);
+    // it has our listening sockets, so make sure it is gone (and reap it, SIGCHLD is not something we listen to)
+    if(kill(pid, SIGKILL) && errno != ESRCH) perror("WARNING kill(new server)");
+    if(waitpid(pid, NULL, 0) == -1) perror("WARNING waitpid(new server)");
+    return false;
+  }
+  printf("INFO new server (pid %d) is accepting\n", pid);
+  return true;
+}
+
+// group whose members may connect to the unix socket listener (only the tor listener can be one)
+static gid_t unix_socket_gid;
+
+#ifndef SO_PEERGROUPS
+#define SO_PEERGROUPS 59
+#endif
+// is a unix socket peer a member of unix_socket_gid, as its primary group or one of its supplementary groups (SO_PEERGROUPS, linux 4.13+)
+static bool peer_in_socket_group(int client, const struct ucred * peer) {
+  if(peer->gid == unix_socket_gid) return true;
+  gid_t few_groups[64]; gid_t * groups = few_groups; socklen_t length = sizeof(few_groups);
+  if(getsockopt(client, SOL_SOCKET, SO_PEERGROUPS, groups, &length)) {
+    if(errno != ERANGE) { perror("WARNING getsockopt(SO_PEERGROUPS)"); return false; }
+    // length is now what it takes
+    groups = malloc(length); if(!groups) { perror("malloc(peer groups)"); return false; }
+    if(getsockopt(client, SOL_SOCKET, SO_PEERGROUPS, groups, &length)) { perror("WARNING getsockopt(SO_PEERGROUPS)"); free(groups); return false; }
+  }
+  bool member = false;
+  for(size_t i = 0; i < length / sizeof(gid_t); i++) member |= groups[i] == unix_socket_gid;
+  if(groups != few_groups) free(groups);
+  return member;
+}
+
+// listen on a port, or on a unix socket if path is not NULL
+int prep_server_socket(struct pollfd * sockets, size_t * sockets_size, uint16_t port, const char * path, int backlog) {
+  int server;
+  if(inherited_sockets_used < inherited_sockets_size) {
+    server = inherited_sockets[inherited_sockets_used++];
+  } else if(path) {
+    struct sockaddr_un address = { AF_UNIX };
+    if(strlen(path) >= sizeof(address.sun_path)) { fprintf(stderr, "unix socket path too long %s\n", path); exit(EXIT_FAILURE); }
+    strcpy(address.sun_path, path);
+    server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0); if(server == -1) { perror("socket(unix)"); exit(EXIT_FAILURE); }
+    // left over by a previous run (but don't go deleting anything else)
+    struct stat path_stat; if(!lstat(path, &path_stat)) { if(!S_ISSOCK(path_stat.st_mode)) { fprintf(stderr, "%s exists and is not a socket\n", path); exit(EXIT_FAILURE); } if(unlink(path)) { perror("unlink(unix socket)"); exit(EXIT_FAILURE); } }
+    if(bind(server, (const struct sockaddr *)&address, sizeof(address))) { perror("bind(unix server)"); fprintf(stderr, "path %s\n", path); exit(EXIT_FAILURE); }
+    // owner and group only, the group being the one of the folder if it is setgid (e.g. shared with tor)
+    if(chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP)) { perror("chmod(unix socket)"); exit(EXIT_FAILURE); }
+    if(listen(server, backlog)) { perror("listen(unix)"); exit(EXIT_FAILURE); }
+  } else {
+    server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); if(server == -1) { perror("socket()"); exit(EXIT_FAILURE); }
+    if(setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int))) { perror("setsockopt()"); exit(EXIT_FAILURE); }
+    if(bind(server, (const struct sockaddr *)&(struct sockaddr_in){AF_INET, htons(port), {INADDR_ANY}}, sizeof(struct sockaddr_in))) {
+      perror("bind(server)");
+      if(port < 1024) fprintf(stderr, "for privileged ports, ensure capability is set\nsudo setcap 'cap_net_bind_service=+ep' /path/to/program\n");
+      exit(EXIT_FAILURE);
+    }
+    if(listen(server, backlog)) { perror("listen()"); exit(EXIT_FAILURE); }
   }
-  if(listen(server, backlog)) { perror("listen()"); exit(EXIT_FAILURE); }
+  if(path) { struct stat path_stat; if(stat(path, &path_stat)) { perror("stat(unix socket)"); exit(EXIT_FAILURE); } unix_socket_gid = path_stat.st_gid; }
   sockets[*sockets_size].fd = server;
   sockets[*sockets_size].events = POLLIN;
   (*sockets_size)++;
@@ -65,13 +316,14 @@ int prep_server_socket(struct pollfd * sockets, size_t * sockets_size, uint16_t
 // send a file to a socket, but search and replace a few things as we go
 // note: for performance reasons, only the first occurence will be replaced
 // side effect: the arrays from/to will be modified in place for performance reasons as well
-void send_template_file(int socket, int file, const char * from[], const char * to[], int n) {
+// returns false if the client could not be sent to
+bool send_template_file(int socket, struct site_file * file, const char * from[], const char * to[], int n) {
   size_t max_from_len = 0; for(int i = 0; i < n; i++) { size_t len = strlen(from[i]); if(len > max_from_len) max_from_len = len; }
   size_t K = 1024;
   size_t buffer_cap = K + max_from_len;
   uint8_t buffer[buffer_cap + 1];
   char * found[n];
-  size_t readn = read(file, buffer, buffer_cap);
+  size_t readn = site_read(file, buffer, buffer_cap);
   size_t shifted = 0;
   while(readn) {
     if(readn == -1) { perror("read(send_template_file)"); exit(EXIT_FAILURE); }
@@ -99,10 +351,10 @@ void send_template_file(int socket, int file, const char * from[], const char *
     while(n > 0 && found[0]) {
       size_t count = (uint8_t *)found[0] - head;
       ssize_t sent;
-      sent = send(socket, head, count, MSG_MORE); if(sent != count) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); exit(EXIT_FAILURE); }
+      sent = send(socket, head, count, MSG_MORE); if(sent != count) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); return false; }
       readn -= sent;
       size_t len = strlen(to[0]);
-      sent = send(socket, to[0], len, MSG_MORE); if(sent != len) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); exit(EXIT_FAILURE); }
+      sent = send(socket, to[0], len, MSG_MORE); if(sent != len) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); return false; }
       len = strlen(from[0]);
       head = found[0] + len;
       readn -= len;
@@ -116,23 +368,24 @@ void send_template_file(int socket, int file, const char * from[], const char *
     }
     // send rest of the bytes (except the overflow of partial match if it's still there and we still care)
     if(n == 0) {
-      ssize_t sent = send(socket, head, readn, MSG_MORE); if(sent != readn) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); exit(EXIT_FAILURE); }
-      readn = read(file, buffer, buffer_cap);
+      ssize_t sent = send(socket, head, readn, MSG_MORE); if(sent != readn) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); return false; }
+      readn = site_read(file, buffer, buffer_cap);
       shifted = 0;
     } else {
       if(readn > max_from_len) {
-        ssize_t sent = send(socket, head, readn - max_from_len, MSG_MORE); if(sent != readn - max_from_len) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); exit(EXIT_FAILURE); }
+        ssize_t sent = send(socket, head, readn - max_from_len, MSG_MORE); if(sent != readn - max_from_len) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); return false; }
         head += readn - max_from_len;
         readn = max_from_len;
       }
       // shift overflow and read up to K more bytes
       if(readn > 0) memmove(buffer, head, readn);
       shifted = readn;
-      readn = read(file, buffer + readn, buffer_cap - readn);
+      readn = site_read(file, buffer + readn, buffer_cap - readn);
     }
   }
   // send what is left in buffer (the max_from_len), or send nothing
-  ssize_t sent = send(socket, buffer, shifted, 0); if(sent != shifted) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); exit(EXIT_FAILURE); }
+  ssize_t sent = send(socket, buffer, shifted, 0); if(sent != shifted) { if(sent == -1) perror("send(send_template_file)"); else fprintf(stderr, "send(send_template_file): couldn't send whole message, sent only %zu.\n", sent); return false; }
+  return true;
 }
 
 // C workaround to switch on string (i.e. hash them)
@@ -159,8 +412,8 @@ uint32_t hash_djb2(const char * s) { uint32_t hash = 5381; while(*s) hash = ((ha
 
 // -- Web Server --
 
-// mime type for various static files
-bool send_static_header(int client, uint32_t hash_djb2_ext) {
+// mime type for various static files (NULL if not a static file)
+const char * static_mime(uint32_t hash_djb2_ext) {
   const char * mime;
   switch(hash_djb2_ext) {
     case hash_djb2_css: mime = "text/css"; break;
@@ -177,11 +430,22 @@ bool send_static_header(int client, uint32_t hash_djb2_ext) {
     case hash_djb2_ttf: mime = "application/x-font-ttf"; break;
     case hash_djb2_txt: mime = "text/plain"; break;
     case hash_djb2_ogg: mime = "audio/ogg"; break;
-    default: return false;
+    default: return NULL;
   }
-  char buffer[96];
-  size_t length = sprintf(buffer, "HTTP/1.1 200 OK\r\nContent-Type:%s\r\n\r\n", mime);
-  ssize_t sent = send(client, buffer, length, MSG_MORE); if(sent != length) { if(sent == -1) perror("send(send_static_header)"); else fprintf(stderr, "send(send_static_header(%u)): couldn't send whole message, sent only %zu.\n", hash_djb2_ext, sent); exit(EXIT_FAILURE); }
+  return mime;
+}
+
+// entry is the bundled file being sent (NULL if not from a bundle), for its validators
+bool send_static_header(int client, const char * mime, const struct bundle_entry * entry) {
+  char buffer[192];
+  size_t length = sprintf(buffer, "HTTP/1.1 200 OK\r\nContent-Type:%s\r\n", mime);
+  if(entry) {
+    length += sprintf(buffer + length, "ETag:\"%016" PRIx64 "\"\r\n", entry->etag);
+    struct tm mtime; time_t seconds = entry->mtime;
+    if(gmtime_r(&seconds, &mtime)) length += strftime(buffer + length, sizeof(buffer) - length, "Last-Modified:%a, %d %b %Y %H:%M:%S GMT\r\n", &mtime);
+  }
+  length += sprintf(buffer + length, "\r\n");
+  ssize_t sent = send(client, buffer, length, MSG_MORE); if(sent != length) { if(sent == -1) perror("send(send_static_header)"); else fprintf(stderr, "send(send_static_header(%s)): couldn't send whole message, sent only %zu.\n", mime, sent); return false; }
   return true;
 }
 
@@ -194,95 +458,552 @@ bool send_static_header(int client, uint32_t hash_djb2_ext) {
 
 bool do404(int client) {
   ssize_t sent = send(client, HTTP_404_HEADER, HTTP_404_HEADER_LEN, MSG_MORE); if(sent != HTTP_404_HEADER_LEN) { if(sent == -1) perror("send()"); else fprintf(stderr, "send(): couldn't send whole message, sent only %zu.\n", sent); return false; }
-  int file = open("naws/404.inc", O_RDONLY); if(file == -1) { perror("open(404.inc)"); exit(EXIT_FAILURE); } struct stat file_stat; if(fstat(file, &file_stat)) { perror("fstat(404.inc)"); exit(EXIT_FAILURE); }
-  sent = sendfile(client, file, NULL, file_stat.st_size); if(sent != file_stat.st_size) { if(sent == -1) perror("sendfile()"); else fprintf(stderr, "sendfile(404): couldn't send whole message, sent only %zu.\n", sent); close(file); return false; }
-  if(close(file)) { perror("close(404.inc)"); exit(EXIT_FAILURE); }
+  struct site_file file; if(!site_open("naws/404.inc", &file)) { perror("open(404.inc)"); exit(EXIT_FAILURE); }
+  sent = site_sendfile(client, &file); if(sent != file.size) { if(sent == -1) perror("sendfile()"); else fprintf(stderr, "sendfile(404): couldn't send whole message, sent only %zu.\n", sent); site_close(&file); return false; }
+  if(site_close(&file)) { perror("close(404.inc)"); exit(EXIT_FAILURE); }
+  return true;
+}
+
+// -- Deadlines --
+
+// without them, idle or slow clients (e.g. slowloris through tor) hold on to a thread data each until there is none left
+#define deadline_header_ms (10 * 1000) // from accept to having received the request (tls handshake included)
+#define deadline_send_ms (30 * 1000) // for each send_chunk of the response to go out
+#define send_chunk (256 * 1024)
+
+// hierarchical timer wheel, serviced by timer_routine()
+// level 0 has a slot per tick, each next level has slots wheel_slots times as wide, whose timers cascade down a level when their slot comes up
+// so arming, cancelling and expiring a timer are O(1), no matter how many connections there are
+#define wheel_tick_ms 100
+#define wheel_bits 6
+#define wheel_slots (1 << wheel_bits)
+#define wheel_levels 4
+struct timer {
+  struct timer * next;
+  struct timer ** prev_next; // NULL when not armed
+  uint64_t expires; // in ticks
+  void (*expire)(struct timer * timer); // called from the timer thread, with wheel_mutex held
+};
+static struct timer * wheel[wheel_levels][wheel_slots];
+static uint64_t wheel_now; // in ticks
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void wheel_insert(struct timer * timer) {
+  if(timer->expires <= wheel_now) timer->expires = wheel_now + 1;
+  uint64_t delta = timer->expires - wheel_now;
+  int level = 0;
+  // (beyond the last level, a timer cascades early and just gets re-inserted)
+  while(level < wheel_levels - 1 && delta >= UINT64_C(1) << (wheel_bits * (level + 1))) level++;
+  struct timer ** slot = &wheel[level][(timer->expires >> (wheel_bits * level)) & (wheel_slots - 1)];
+  timer->next = *slot; if(timer->next) timer->next->prev_next = &timer->next;
+  timer->prev_next = slot; *slot = timer;
+}
+
+static void wheel_remove(struct timer * timer) {
+  *timer->prev_next = timer->next; if(timer->next) timer->next->prev_next = timer->prev_next;
+  timer->next = NULL; timer->prev_next = NULL;
+}
+
+// (re)arm a timer to expire in ms
+static void timer_arm(struct timer * timer, uint64_t ms) {
+  if(pthread_mutex_lock(&wheel_mutex)) { perror("pthread_mutex_lock(wheel)"); exit(EXIT_FAILURE); }
+  if(timer->prev_next) wheel_remove(timer);
+  timer->expires = wheel_now + (ms + wheel_tick_ms - 1) / wheel_tick_ms;
+  wheel_insert(timer);
+  if(pthread_mutex_unlock(&wheel_mutex)) { perror("pthread_mutex_unlock(wheel)"); exit(EXIT_FAILURE); }
+}
+
+// once this returns, the timer won't expire (or is done expiring)
+static void timer_cancel(struct timer * timer) {
+  if(pthread_mutex_lock(&wheel_mutex)) { perror("pthread_mutex_lock(wheel)"); exit(EXIT_FAILURE); }
+  if(timer->prev_next) wheel_remove(timer);
+  if(pthread_mutex_unlock(&wheel_mutex)) { perror("pthread_mutex_unlock(wheel)"); exit(EXIT_FAILURE); }
+}
+
+static void wheel_tick() {
+  wheel_now++;
+  // cascade the higher level slots that just came up
+  for(int level = 1; level < wheel_levels && !(wheel_now & ((UINT64_C(1) << (wheel_bits * level)) - 1)); level++) {
+    struct timer * timer = wheel[level][(wheel_now >> (wheel_bits * level)) & (wheel_slots - 1)];
+    while(timer) { struct timer * next = timer->next; wheel_remove(timer); wheel_insert(timer); timer = next; }
+  }
+  struct timer * timer = wheel[0][wheel_now & (wheel_slots - 1)];
+  while(timer) {
+    struct timer * next = timer->next;
+    if(timer->expires <= wheel_now) { wheel_remove(timer); timer->expire(timer); }
+    timer = next;
+  }
+}
+
+// work too slow to be done with wheel_mutex held (it would stall every arm/cancel), expire callbacks only flag it
+static bool pool_trim_due;
+static void pool_trim();
+
+static void * timer_routine(void * vargp) {
+  struct timespec next; if(clock_gettime(CLOCK_MONOTONIC, &next)) { perror("clock_gettime"); exit(EXIT_FAILURE); }
+  while(true) {
+    next.tv_nsec += wheel_tick_ms * 1000000; if(next.tv_nsec >= 1000000000) { next.tv_nsec -= 1000000000; next.tv_sec++; }
+    int ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL); if(ret && ret != EINTR) { fprintf(stderr, "clock_nanosleep %s\n", strerror(ret)); exit(EXIT_FAILURE); }
+    if(pthread_mutex_lock(&wheel_mutex)) { perror("pthread_mutex_lock(wheel)"); exit(EXIT_FAILURE); }
+    wheel_tick();
+    bool trim = pool_trim_due; pool_trim_due = false;
+    if(pthread_mutex_unlock(&wheel_mutex)) { perror("pthread_mutex_unlock(wheel)"); exit(EXIT_FAILURE); }
+    if(trim) pool_trim();
+  }
+}
+
+// -- Memory --
+
+// backing buffers come from a pool shared by all threads, in power of two size classes (pool_min_size and up)
+// they are mmap'ed so that the ones left idle for pool_idle_ms can really be given back to the system (see pool_trim())
+// bigger than the last class, they are mmap'ed and unmapped on the spot
+#define pool_min_size (16 * 1024)
+#define pool_classes 12
+#define pool_idle_ms (30 * 1000)
+#define pool_trim_interval_ms (5 * 1000)
+// a free block holds its own bookkeeping
+struct pool_free_block {
+  struct pool_free_block * next;
+  uint64_t released_ms;
+};
+static struct pool_free_block * pool_free[pool_classes]; // most recently released first
+static size_t pool_free_count[pool_classes];
+static size_t pool_used_count[pool_classes];
+static size_t pool_oversized_count;
+static size_t pool_oversized_bytes;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int pool_class(size_t size) {
+  int c = 0; while(c < pool_classes && ((size_t)pool_min_size << c) < size) c++;
+  return c;
+}
+
+static size_t page_round(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  return (size + page_size - 1) / page_size * page_size;
+}
+
+// capacity is set to the usable size, which is what pool_release() wants back
+static void * pool_acquire(size_t size, size_t * capacity) {
+  int c = pool_class(size);
+  *capacity = c < pool_classes? (size_t)pool_min_size << c : page_round(size);
+  struct pool_free_block * block = NULL;
+  if(pthread_mutex_lock(&pool_mutex)) { perror("pthread_mutex_lock(pool)"); exit(EXIT_FAILURE); }
+  if(c < pool_classes) {
+    block = pool_free[c];
+    if(block) { pool_free[c] = block->next; pool_free_count[c]--; }
+    pool_used_count[c]++;
+  } else {
+    pool_oversized_count++;
+    pool_oversized_bytes += *capacity;
+  }
+  if(pthread_mutex_unlock(&pool_mutex)) { perror("pthread_mutex_unlock(pool)"); exit(EXIT_FAILURE); }
+  if(block) return block;
+  void * memory = mmap(NULL, *capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); if(memory == MAP_FAILED) { perror("mmap(pool)"); exit(EXIT_FAILURE); }
+  return memory;
+}
+
+static void pool_release(void * memory, size_t capacity) {
+  int c = pool_class(capacity);
+  if(pthread_mutex_lock(&pool_mutex)) { perror("pthread_mutex_lock(pool)"); exit(EXIT_FAILURE); }
+  if(c < pool_classes) {
+    struct pool_free_block * block = memory;
+    block->released_ms = get_monotonic_ms();
+    block->next = pool_free[c]; pool_free[c] = block;
+    pool_free_count[c]++;
+    pool_used_count[c]--;
+    memory = NULL;
+  } else {
+    pool_oversized_count--;
+    pool_oversized_bytes -= capacity;
+  }
+  if(pthread_mutex_unlock(&pool_mutex)) { perror("pthread_mutex_unlock(pool)"); exit(EXIT_FAILURE); }
+  if(memory && munmap(memory, capacity)) { perror("munmap(pool)"); exit(EXIT_FAILURE); }
+}
+
+static size_t get_rss() {
+  FILE * statm = fopen("/proc/self/statm", "r"); if(!statm) { perror("fopen(statm)"); return 0; }
+  size_t size, resident; if(fscanf(statm, "%zu %zu", &size, &resident) != 2) resident = 0;
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// report rss and what the pool holds, per size class (on SIGUSR1, and when the pool gets trimmed)
+static void pool_report() {
+  size_t used_bytes = 0, free_bytes = 0;
+  char classes[pool_classes * 32]; char * p = classes; *p = '\0';
+  if(pthread_mutex_lock(&pool_mutex)) { perror("pthread_mutex_lock(pool)"); exit(EXIT_FAILURE); }
+  for(int c = 0; c < pool_classes; c++) {
+    size_t size = (size_t)pool_min_size << c;
+    used_bytes += pool_used_count[c] * size; free_bytes += pool_free_count[c] * size;
+    if(pool_used_count[c] || pool_free_count[c]) p += sprintf(p, " %zuK:%zu/%zu", size / 1024, pool_used_count[c], pool_free_count[c]);
+  }
+  used_bytes += pool_oversized_bytes;
+  size_t oversized_count = pool_oversized_count;
+  if(pthread_mutex_unlock(&pool_mutex)) { perror("pthread_mutex_unlock(pool)"); exit(EXIT_FAILURE); }
+  printf("INFO rss %zu KiB, pool in use %zu KiB, idle %zu KiB, oversized %zu, class used/idle%s\n", get_rss() / 1024, used_bytes / 1024, free_bytes / 1024, oversized_count, classes);
+}
+
+// give back the blocks idle for too long
+static void pool_trim() {
+  uint64_t now = get_monotonic_ms();
+  struct pool_free_block * trimmed[pool_classes] = { NULL };
+  size_t trimmed_count = 0;
+  if(pthread_mutex_lock(&pool_mutex)) { perror("pthread_mutex_lock(pool)"); exit(EXIT_FAILURE); }
+  for(int c = 0; c < pool_classes; c++) {
+    // most recently released first, so once one is old enough, so is the rest of the list
+    struct pool_free_block ** link = &pool_free[c];
+    while(*link && (*link)->released_ms + pool_idle_ms > now) link = &(*link)->next;
+    trimmed[c] = *link; *link = NULL;
+    for(struct pool_free_block * block = trimmed[c]; block; block = block->next) { pool_free_count[c]--; trimmed_count++; }
+  }
+  if(pthread_mutex_unlock(&pool_mutex)) { perror("pthread_mutex_unlock(pool)"); exit(EXIT_FAILURE); }
+  if(!trimmed_count) return;
+  for(int c = 0; c < pool_classes; c++) {
+    struct pool_free_block * block = trimmed[c];
+    while(block) { struct pool_free_block * next = block->next; if(munmap(block, (size_t)pool_min_size << c)) { perror("munmap(pool)"); exit(EXIT_FAILURE); } block = next; }
+  }
+  printf("INFO trimmed %zu idle blocks from pool\n", trimmed_count);
+  pool_report();
+}
+
+// the timer thread does the trimming, once it let go of wheel_mutex
+static struct timer pool_trim_timer;
+static void pool_trim_expired(struct timer * timer) {
+  pool_trim_due = true;
+  // (wheel_mutex is held, re-insert directly)
+  timer->expires = wheel_now + pool_trim_interval_ms / wheel_tick_ms;
+  wheel_insert(timer);
+}
+
+// per thread arena for what only lives as long as a request (request buffer, paths, auth scratch, template values)
+// allocating is bumping a pointer, and all of it is let go at once when the request is done
+struct arena_block {
+  struct arena_block * previous;
+  size_t capacity;
+};
+struct arena {
+  struct arena_block * block; // NULL when empty
+  size_t used;
+};
+#define arena_align 16
+
+static void * arena_alloc(struct arena * arena, size_t size) {
+  size = (size + arena_align - 1) / arena_align * arena_align;
+  if(!arena->block || arena->used + size > arena->block->capacity) {
+    size_t capacity;
+    struct arena_block * block = pool_acquire(sizeof(struct arena_block) + size, &capacity);
+    block->previous = arena->block;
+    block->capacity = capacity;
+    arena->block = block;
+    arena->used = (sizeof(struct arena_block) + arena_align - 1) / arena_align * arena_align;
+  }
+  void * memory = (uint8_t *)arena->block + arena->used;
+  arena->used += size;
+  return memory;
+}
+
+static void arena_reset(struct arena * arena) {
+  // (a request almost always fits in one block)
+  while(arena->block) { struct arena_block * previous = arena->block->previous; pool_release(arena->block, arena->block->capacity); arena->block = previous; }
+  arena->used = 0;
 }
 
 // thread
 #define buffer_capacity 8191
 #define thread_max 256
 struct thread_data {
-  uint8_t * buffer;
+  struct arena arena;
   size_t child_stdout_buffer_capacity;
-  uint8_t * child_stdout_buffer;
+  uint8_t * child_stdout_buffer; // from the pool, for the duration of a program run
   bool in_use;
   int client;
   int thread_id;
   bool private_network_client;
+  bool tls_client;
+#ifdef NAWS_TLS
+  SSL * ssl;
+#endif
+  struct timer deadline;
+  const char * deadline_phase;
 };
 
 static void * thread_routine(void * vargp);
-static int sigchld_fd;
+
+static uint64_t deadlines_expired; // with wheel_mutex held
+
+// the thread is blocked in the socket, shutting it down wakes it up with an error (it closes the socket after cancelling the timer, so the fd is still ours)
+static void deadline_expired(struct timer * timer) {
+  struct thread_data * t = (struct thread_data *)((uint8_t *)timer - offsetof(struct thread_data, deadline));
+  deadlines_expired++;
+  printf("WARNING t%d %s deadline expired, closing client (%" PRIu64 " so far)\n", t->thread_id, t->deadline_phase, deadlines_expired);
+  if(shutdown(t->client, SHUT_RDWR)) perror("WARNING shutdown(expired client)");
+}
+
+static void deadline_arm(struct thread_data * t, const char * phase, uint64_t ms) {
+  t->deadline_phase = phase;
+  t->deadline.expire = deadline_expired;
+  timer_arm(&t->deadline, ms);
+}
+
+// send a site file in chunks, each one with its own deadline (so slow but steady clients are fine)
+static bool send_file_paced(struct thread_data * t, struct site_file * file, ssize_t * total_sent) {
+  off_t offset = file->offset;
+  off_t end = file->offset + file->size;
+  while(offset < end) {
+    deadline_arm(t, "send", deadline_send_ms);
+    size_t count = end - offset < send_chunk? end - offset : send_chunk;
+    ssize_t sent = sendfile(t->client, file->fd, &offset, count); if(sent <= 0) { if(sent == -1) perror("sendfile(paced)"); break; }
+  }
+  *total_sent = offset - file->offset;
+  return offset == end;
+}
+
+static bool send_paced(struct thread_data * t, const uint8_t * buffer, size_t length) {
+  size_t done = 0;
+  while(done < length) {
+    deadline_arm(t, "send", deadline_send_ms);
+    size_t count = length - done < send_chunk? length - done : send_chunk;
+    ssize_t sent = send(t->client, buffer + done, count, 0); if(sent <= 0) { if(sent == -1) perror("send(paced)"); return false; }
+    done += sent;
+  }
+  return true;
+}
+
+// -- TLS --
+
+// TLS 1.3 only, and only to get the handshake done. Once the keys are known, the record layer is handed to the kernel (kTLS)
+// so that plain send()/sendfile() on the client socket keep working (and stay zero-copy) on encrypted connections.
+// The certificate is meant to be self-signed or from a private CA, since this listener is for the home network.
+#ifdef NAWS_TLS
+static SSL_CTX * tls_context;
+
+// returns NULL on failure (so a reload with a bad certificate keeps the current one)
+static SSL_CTX * prep_tls_context() {
+  SSL_CTX * context = SSL_CTX_new(TLS_server_method()); if(!context) { ERR_print_errors_fp(stderr); return NULL; }
+  if(!SSL_CTX_set_min_proto_version(context, TLS1_3_VERSION)) goto fail;
+  // only the ciphers linux knows how to offload
+  if(!SSL_CTX_set_ciphersuites(context, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256")) goto fail;
+  SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+  // session tickets are post-handshake messages, we have no use for resumption and they would only get in the way of the kernel
+  if(!SSL_CTX_set_num_tickets(context, 0)) goto fail;
+  if(SSL_CTX_use_certificate_chain_file(context, "naws/tls.crt") != 1) { fprintf(stderr, "path naws/tls.crt\n"); goto fail; }
+  if(SSL_CTX_use_PrivateKey_file(context, "naws/tls.key", SSL_FILETYPE_PEM) != 1) { fprintf(stderr, "path naws/tls.key\n"); goto fail; }
+  if(SSL_CTX_check_private_key(context) != 1) goto fail;
+  return context;
+  fail:
+  ERR_print_errors_fp(stderr);
+  SSL_CTX_free(context);
+  return NULL;
+}
+
+// the SSL object is created by main() when handing the client to a thread, so a reload can swap tls_context safely
+static bool tls_accept(struct thread_data * t) {
+  if(SSL_set_fd(t->ssl, t->client) != 1) { ERR_print_errors_fp(stderr); exit(EXIT_FAILURE); }
+  if(SSL_accept(t->ssl) != 1) { fprintf(stderr, "WARNING t%d SSL_accept() failed\n", t->thread_id); ERR_print_errors_fp(stderr); return false; }
+  // everything we send after this point bypasses openssl, so without the kernel doing the encryption we can't serve this client
+  if(!BIO_get_ktls_send(SSL_get_wbio(t->ssl))) { fprintf(stderr, "ERROR t%d kernel TLS offload unavailable (cipher %s), is the tls module loaded? (modprobe tls)\n", t->thread_id, SSL_get_cipher_name(t->ssl)); return false; }
+  return true;
+}
+
+// the request itself may already sit in openssl's buffers (or the kernel may not do receive offload), so always read through openssl
+static ssize_t tls_recv(struct thread_data * t, uint8_t * buffer, size_t length) {
+  int n = SSL_read(t->ssl, buffer, length);
+  if(n <= 0) { int error = SSL_get_error(t->ssl, n); if(error == SSL_ERROR_ZERO_RETURN) return 0; fprintf(stderr, "WARNING t%d SSL_read() error %d\n", t->thread_id, error); ERR_print_errors_fp(stderr); return -1; }
+  return n;
+}
+
+static void tls_close(struct thread_data * t) {
+  if(!t->ssl) return;
+  if(SSL_is_init_finished(t->ssl)) SSL_shutdown(t->ssl);
+  SSL_free(t->ssl);
+  t->ssl = NULL;
+}
+#else
+static bool tls_accept(struct thread_data * t) { fprintf(stderr, "ERROR t%d built without NAWS_TLS\n", t->thread_id); return false; }
+static ssize_t tls_recv(struct thread_data * t, uint8_t * buffer, size_t length) { return -1; }
+static void tls_close(struct thread_data * t) { }
+#endif
 
 // main
+enum listener { LISTENER_PRIVATE, LISTENER_TOR, LISTENER_TLS };
+static const char * listener_names[] = { "private", "tor", "tls" };
+
 int main(int argc, char * argv[]) {
-  if(argc < 3) { fprintf(stderr, "usage: naws root-folder private_port [tor_port]\nexample: naws . 8888 8889\n"); exit(EXIT_FAILURE); }
+  if(argc < 3) { fprintf(stderr, "usage: naws root-folder|site.bundle private_port [tor_port|tor_socket_path [tls_port]]\nexample: naws . 8888 8889\na port of 0 disables that listener, a relative socket path is relative to the current folder\n"); exit(EXIT_FAILURE); }
   if(setvbuf(stdout, NULL, _IOLBF, 0)) { perror("setvbuf"); exit(EXIT_FAILURE); };
-  mute_signals();
+  int signal_fd = mute_signals();
   srandom(time(0));
   char * strtol_endptr;
+  receive_inherited_sockets();
 
   // args
-  if(chdir(argv[1])) { perror("chdir(root)"); exit(EXIT_FAILURE); }
+  int launch_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC); if(launch_dir == -1) { perror("open(launch dir)"); exit(EXIT_FAILURE); }
+  // a relative unix socket path is relative to where we are launched, not to the root we are about to chdir into
+  char tor_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path) + 1] = "";
+  if(argc >= 4) {
+    size_t length = 0;
+    if(argv[3][0] != '/') { if(!getcwd(tor_socket_path, sizeof(tor_socket_path))) { perror("getcwd(tor socket path)"); exit(EXIT_FAILURE); } length = strlen(tor_socket_path); tor_socket_path[length++] = '/'; }
+    if(length + strlen(argv[3]) >= sizeof(tor_socket_path)) { fprintf(stderr, "unix socket path too long %s\n", argv[3]); exit(EXIT_FAILURE); }
+    strcpy(tor_socket_path + length, argv[3]);
+  }
+  struct stat root_stat; if(stat(argv[1], &root_stat)) { perror("stat(root)"); exit(EXIT_FAILURE); }
+  if(S_ISREG(root_stat.st_mode)) {
+    // a bundle, programs run from the folder it is in
+    load_bundle(argv[1]);
+    char * slash = strrchr(argv[1], '/');
+    if(slash) { char folder[slash - argv[1] + 2]; memcpy(folder, argv[1], slash - argv[1] + 1); folder[slash - argv[1] + 1] = '\0'; if(chdir(folder)) { perror("chdir(bundle folder)"); exit(EXIT_FAILURE); } }
+  } else {
+    if(chdir(argv[1])) { perror("chdir(root)"); exit(EXIT_FAILURE); }
+  }
   uint16_t private_port = strtol(argv[2], &strtol_endptr, 10); if(*strtol_endptr) { fprintf(stderr, "could not parse private port %s\n", argv[2]); exit(EXIT_FAILURE); }
   uint16_t tor_port = 0;
-  if(argc == 4) { tor_port = strtol(argv[3], &strtol_endptr, 10); if(*strtol_endptr) { fprintf(stderr, "could not parse tor port %s\n", argv[3]); exit(EXIT_FAILURE); } }
+  // anything but a number is a unix socket path (already resolved against the launch folder above)
+  const char * tor_path = NULL;
+  if(argc >= 4) { tor_port = strtol(argv[3], &strtol_endptr, 10); if(*strtol_endptr) tor_path = tor_socket_path; }
+  uint16_t tls_port = 0;
+  if(argc >= 5) { tls_port = strtol(argv[4], &strtol_endptr, 10); if(*strtol_endptr) { fprintf(stderr, "could not parse tls port %s\n", argv[4]); exit(EXIT_FAILURE); } }
+#ifndef NAWS_TLS
+  if(tls_port) { fprintf(stderr, "tls port requested but naws was built without NAWS_TLS\n"); exit(EXIT_FAILURE); }
+#endif
 
-  // setup sockets (for private network port and tor network port)
-  struct pollfd sockets[2];
+  // setup sockets (for private network port, tor network port and tls port, plus the signals)
+  struct pollfd sockets[4];
+  enum listener listeners[3];
+  bool unix_listeners[3] = { false };
   size_t sockets_size = 0;
   // in this context, the private server is meant for local network traffic only, no credentials are asked for traffic on this port
-  prep_server_socket(sockets, &sockets_size, private_port, thread_max / 2);
+  // (it can be turned off, e.g. to only serve the private network over tls)
+  if(private_port) { listeners[sockets_size] = LISTENER_PRIVATE; prep_server_socket(sockets, &sockets_size, private_port, NULL, thread_max / 2); }
   // in this context, what I call the tor server is a port that only accepts localhost connections
   // as if torrc is setup like: HiddenServicePort 80 127.0.0.1:12345 where 12345 is the tor_port
+  // or better, a unix socket: HiddenServicePort 80 unix:/run/naws/tor.sock (no loopback tcp, no port to expose, and peers are checked by credentials instead of address)
   // I later assume end-to-end encryption on this port, so that asking for credentials over http is sensical.
-  if(tor_port) prep_server_socket(sockets, &sockets_size, tor_port, thread_max / 2);
+  if(tor_port) { listeners[sockets_size] = LISTENER_TOR; prep_server_socket(sockets, &sockets_size, tor_port, NULL, thread_max / 2); }
+  if(tor_path) { listeners[sockets_size] = LISTENER_TOR; unix_listeners[sockets_size] = true; prep_server_socket(sockets, &sockets_size, 0, tor_path, thread_max / 2); }
+  // the tls server is the private server, encrypted (e.g. for the home wifi), with a self-signed or private CA certificate
+#ifdef NAWS_TLS
+  if(tls_port) { tls_context = prep_tls_context(); if(!tls_context) exit(EXIT_FAILURE); listeners[sockets_size] = LISTENER_TLS; prep_server_socket(sockets, &sockets_size, tls_port, NULL, thread_max / 2); }
+#endif
+  if(!sockets_size) { fprintf(stderr, "every listener is disabled, nothing to serve\n"); exit(EXIT_FAILURE); }
+  sockets[sockets_size].fd = signal_fd;
+  sockets[sockets_size].events = POLLIN;
+  acknowledge_inherited_sockets();
 
   // listen for clients
   struct sockaddr_in client_addr;
   struct thread_data * thread_data = calloc(thread_max, sizeof(struct thread_data));
+  bool draining = false;
+  {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, timer_routine, NULL); if(ret) { fprintf(stderr, "could not start timer thread %d %s\n", ret, strerror(ret)); exit(EXIT_FAILURE); }
+    ret = pthread_detach(thread); if(ret) { fprintf(stderr, "could not detach timer thread %d %s\n", ret, strerror(ret)); exit(EXIT_FAILURE); }
+    pool_trim_timer.expire = pool_trim_expired;
+    timer_arm(&pool_trim_timer, pool_trim_interval_ms);
+  }
   while(true) {
-    int socked_polled = poll(sockets, sockets_size, -1); if(socked_polled == -1) { perror("poll()"); exit(EXIT_FAILURE); }
+    int socked_polled = poll(sockets, sockets_size + 1, draining? 100 : -1); if(socked_polled == -1) { perror("poll()"); exit(EXIT_FAILURE); }
+
+    // signals
+    if(sockets[sockets_size].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      ssize_t n = read(signal_fd, &info, sizeof(info)); if(n != sizeof(info)) { perror("read(signalfd)"); exit(EXIT_FAILURE); }
+      // reload: keys in naws/ are read on each request already, so only the tls certificate needs reloading
+      // (not so from a bundle, its keys are part of the snapshot and changing them takes a repack and an upgrade)
+      if(info.ssi_signo == SIGHUP) {
+        printf("INFO reload\n");
+#ifdef NAWS_TLS
+        if(tls_context) {
+          SSL_CTX * context = prep_tls_context();
+          if(!context) fprintf(stderr, "WARNING could not reload tls certificate, keeping the current one\n");
+          else { SSL_CTX_free(tls_context); tls_context = context; }
+        }
+#endif
+      }
+      // memory report
+      else if(info.ssi_signo == SIGUSR1) {
+        pool_report();
+      }
+      // upgrade: hand the listening sockets to a new server, then stop accepting and exit once the current clients are served
+      else if(info.ssi_signo == SIGUSR2 && !draining) {
+        printf("INFO upgrade\n");
+        if(upgrade_server(argv, launch_dir, sockets, sockets_size)) {
+          for(int i = 0; i < sockets_size; i++) if(close(sockets[i].fd)) perror("WARNING close(server)");
+          sockets[0] = sockets[sockets_size];
+          sockets_size = 0;
+          draining = true;
+        }
+      }
+    }
+    if(draining) {
+      int busy = 0; for(int i = 0; i < thread_max; i++) busy += thread_data[i].in_use;
+      if(!busy) { printf("INFO drained, over and out\n"); exit(EXIT_SUCCESS); }
+      continue;
+    }
+
     int client = -1;
     bool private_network_client = false;
-    if(sockets[0].revents & POLLIN) {
-      printf("ACCESS private network request\n");
-      client = accept(sockets[0].fd, (struct sockaddr *)&client_addr, &(socklen_t){sizeof(struct sockaddr_in)}); if(client == -1) { perror("accept(private)"); continue; }
-      private_network_client = true;
-    } else if(sockets[1].revents & POLLIN) {
-      printf("ACCESS tor network request\n");
-      client = accept(sockets[1].fd, (struct sockaddr *)&client_addr, &(socklen_t){sizeof(struct sockaddr_in)}); if(client == -1) { perror("accept(tor)"); continue; }
+    bool tls_client = false;
+    bool unix_client = false;
+    for(int i = 0; i < sockets_size; i++) {
+      if(!(sockets[i].revents & POLLIN)) continue;
+      printf("ACCESS %s network request\n", listener_names[listeners[i]]);
+      unix_client = unix_listeners[i];
+      // close-on-exec, so neither programs nor an upgraded server inherit other clients
+      client = accept4(sockets[i].fd, unix_client? NULL : (struct sockaddr *)&client_addr, unix_client? NULL : &(socklen_t){sizeof(struct sockaddr_in)}, SOCK_CLOEXEC); if(client == -1) { fprintf(stderr, "accept(%s): %s\n", listener_names[listeners[i]], strerror(errno)); break; }
+      PROBE(accept, -1, "", client, listeners[i]);
+      private_network_client = listeners[i] != LISTENER_TOR;
+      tls_client = listeners[i] == LISTENER_TLS;
+      break;
     }
     if(client == -1) continue;
     
+    // unix socket peers are trusted by credentials: root, us, or members of the group the socket belongs to (e.g. tor's)
+    if(unix_client) {
+      struct ucred peer; if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &(socklen_t){sizeof(peer)})) { perror("getsockopt(SO_PEERCRED)"); close(client); continue; }
+      bool allowed_peer = peer.uid == 0 || peer.uid == geteuid() || peer_in_socket_group(client, &peer);
+      PROBE(ip_filter, -1, "", client, allowed_peer);
+      if(!allowed_peer) {
+        fprintf(stderr, "peer pid %d uid %u gid %u was denied access\n", peer.pid, peer.uid, peer.gid);
+        do404(client);
+        close(client);
+        continue;
+      }
+    }
     // allow only the usual private IPv4 addresses
-    uint8_t * ip = (uint8_t *)&client_addr.sin_addr.s_addr;
-    bool allowed_ip = false;
-    allowed_ip |= ip[0] == 127 && ip[1] == 0 && ip[2] == 0 && ip[3] == 1;
-    if(private_network_client) allowed_ip |= ip[0] == 192 && ip[1] == 168;
-    if(!allowed_ip) {
-      fprintf(stderr, "client_address %u.%u.%u.%u was denied access (private=%d)\n", ip[0], ip[1], ip[2], ip[3], private_network_client);
-      do404(client);
-      close(client);
-      continue;
+    else {
+      uint8_t * ip = (uint8_t *)&client_addr.sin_addr.s_addr;
+      bool allowed_ip = false;
+      allowed_ip |= ip[0] == 127 && ip[1] == 0 && ip[2] == 0 && ip[3] == 1;
+      if(private_network_client) allowed_ip |= ip[0] == 192 && ip[1] == 168;
+      PROBE(ip_filter, -1, "", client, allowed_ip);
+      if(!allowed_ip) {
+        fprintf(stderr, "client_address %u.%u.%u.%u was denied access (private=%d)\n", ip[0], ip[1], ip[2], ip[3], private_network_client);
+        // a tls client is in the middle of its handshake, plaintext would only be garbage to it
+        if(!tls_client) do404(client);
+        close(client);
+        continue;
+      }
     }
     // TODO would it be possible to behave exactly like if there was no server? filter ip with SO_ATTACH_BPF?
 
-    // pick the free thread data with the largest buffer
+    // pick a free thread data (they hold no memory between requests, so any will do)
     struct thread_data * data = NULL;
     for(int i = 0; i < thread_max; i++) {
       if(!thread_data[i].in_use) {
-        if(data == NULL || data->child_stdout_buffer_capacity < thread_data[i].child_stdout_buffer_capacity) {
-          data = &thread_data[i];
-          data->thread_id = i;
-        }
+        data = &thread_data[i];
+        data->thread_id = i;
+        break;
       }
     }
-    if(data == NULL) { fprintf(stderr, "could not find any free thread data\n"); close(client); continue; }
+    if(data == NULL) { fprintf(stderr, "could not find any free thread data\n"); PROBE(close, -1, "", client, 0); close(client); continue; }
     data->in_use = true;
     data->client = client;
     data->private_network_client = private_network_client;
+    data->tls_client = tls_client;
+#ifdef NAWS_TLS
+    if(tls_client) { data->ssl = SSL_new(tls_context); if(!data->ssl) { ERR_print_errors_fp(stderr); exit(EXIT_FAILURE); } }
+#endif
 
     // start thread
     pthread_t thread;
@@ -293,61 +1014,93 @@ int main(int argc, char * argv[]) {
   return EXIT_SUCCESS;
 }
 
-void ensure_scratch_and_child_stdout_buffer(uint8_t ** child_stdout_buffer, size_t * child_stdout_buffer_capacity) {
-  if(*child_stdout_buffer_capacity) return;
-  *child_stdout_buffer_capacity = 10 * 1024;
-  *child_stdout_buffer = realloc(NULL, *child_stdout_buffer_capacity);
-  memcpy(*child_stdout_buffer, HTTP_200_HEADER, HTTP_200_HEADER_LEN);
+// the program output is buffered after the start of the response header
+static void acquire_child_stdout_buffer(struct thread_data * t) {
+  t->child_stdout_buffer = pool_acquire(pool_min_size, &t->child_stdout_buffer_capacity);
+  memcpy(t->child_stdout_buffer, HTTP_200_HEADER, HTTP_200_HEADER_LEN);
+}
+
+static void grow_child_stdout_buffer(struct thread_data * t, size_t size) {
+  size_t capacity;
+  uint8_t * buffer = pool_acquire(t->child_stdout_buffer_capacity * 2, &capacity);
+  memcpy(buffer, t->child_stdout_buffer, size);
+  pool_release(t->child_stdout_buffer, t->child_stdout_buffer_capacity);
+  t->child_stdout_buffer = buffer;
+  t->child_stdout_buffer_capacity = capacity;
+}
+
+// exec the interpreter named by the first line of a script (hash_bang has room for the nul at n)
+static void exec_hash_bang(char * hash_bang, ssize_t n, char * script, char * const envp[], int thread_id) {
+  if(n < 2) { fprintf(stderr, "CHILD t%d read(hash_bang) wasn't big enough for hash bang\n", thread_id); exit(EXIT_FAILURE); }
+  if(hash_bang[0] != '#' || hash_bang[1] != '!') { fprintf(stderr, "CHILD t%d not hash bang\n", thread_id); exit(EXIT_FAILURE); }
+  hash_bang[n] = '\0';
+  char * line_sep = &hash_bang[2];
+  char * hash_bang_line = strsep(&line_sep, "\r\n");
+  char * args[] = { NULL, NULL, NULL, NULL };
+  char * command_name = strrchr(hash_bang_line, '/');
+  if(command_name) command_name += 1; else command_name = &hash_bang[2];
+  int i = 0;
+  args[i++] = command_name;
+  if(!strcmp(command_name, "python3") || !strcmp(command_name, "python")) args[i++] = "-B";
+  args[i++] = script;
+  execve(&hash_bang[2], args, envp);
+}
+
+// in the child, run a program from the bundle (never returns)
+// it is copied in a memfd and run as /proc/self/fd/N, from the folder the bundle is in
+static void exec_bundled_program(const char * path, char * filename, uint32_t hash_djb2_ext, char * const envp[], int thread_id) {
+  const struct bundle_entry * entry = bundle_find(path); if(!entry) { fprintf(stderr, "CHILD t%d %s not in bundle\n", thread_id, path); exit(EXIT_FAILURE); }
+  const uint8_t * content = (const uint8_t *)bundle + entry->data_offset;
+  // not close-on-exec, the interpreter of a script needs to open it by path
+  int program = memfd_create(filename, 0); if(program == -1) { perror("CHILD memfd_create()"); exit(EXIT_FAILURE); }
+  // stdin was closed, keep it that way (as in folder mode) rather than have the program read itself from it
+  if(program < 3) { int moved = fcntl(program, F_DUPFD, 3); if(moved == -1) { perror("CHILD fcntl(memfd)"); exit(EXIT_FAILURE); } close(program); program = moved; }
+  for(uint64_t done = 0; done < entry->size;) {
+    ssize_t n = write(program, content + done, entry->size - done); if(n == -1) { perror("CHILD write(memfd)"); exit(EXIT_FAILURE); }
+    done += n;
+  }
+  char program_path[32]; sprintf(program_path, "/proc/self/fd/%d", program);
+  switch(hash_djb2_ext) {
+    case hash_djb2_: {
+      // executable
+      if(entry->mode & S_IXUSR) {
+        char * const args[] = { filename, NULL };
+        fexecve(program, args, envp);
+      }
+      // not executable (manually try to parse first line for #!)
+      else {
+        char hash_bang[1025];
+        ssize_t n = entry->size < 1024? entry->size : 1024;
+        memcpy(hash_bang, content, n);
+        exec_hash_bang(hash_bang, n, program_path, envp, thread_id);
+      }
+      perror("CHILD execve()");
+      break; }
+    case hash_djb2_py: {
+      char * const args[] = { "python3", "-B", program_path, NULL };
+      execve("/usr/bin/python3", args, envp);
+      perror("CHILD execve()");
+      break; }
+  }
+  exit(EXIT_FAILURE);
 }
 
 static void * thread_routine(void * vargp) {
   struct thread_data * t = vargp;
-  if(!t->buffer) t->buffer = malloc(buffer_capacity + 1);
-  uint8_t * buffer = t->buffer;
+  uint8_t * buffer = arena_alloc(&t->arena, buffer_capacity + 1);
   const int client = t->client;
+  const char * traced_uri = "";
+
+  deadline_arm(t, "header", deadline_header_ms);
+
+  // tls handshake (the kernel takes over the record layer afterward)
+  if(t->tls_client && !tls_accept(t)) goto abort_client;
 
   // receive
-  ssize_t length = recv(client, buffer, buffer_capacity, 0); if(length == -1) { perror("recv()"); goto abort_client; }
+  ssize_t length = t->tls_client? tls_recv(t, buffer, buffer_capacity) : recv(client, buffer, buffer_capacity, 0); if(length == -1) { if(!t->tls_client) perror("recv()"); goto abort_client; }
   buffer[length] = '\0';
   if(length < 4) { printf("t%d recv() %zd bytes\n", t->thread_id, length); goto abort_client; }
-  /*
-  if(strncmp(buffer, "GET ", 4)) {
-
-    // tls
-    int index = 0;
-    uint8_t tls_plaintext_type = buffer[index++];
-    uint16_t tls_plaintext_legacy_record_version = (buffer[index] << 8) | buffer[index+1]; index += 2;
-    uint16_t tls_plaintext_length = (buffer[index] << 8) | buffer[index+1]; index += 2;
-    printf("tls_plaintext_type: %u\n", tls_plaintext_type);
-    printf("tls_plaintext_legacy_record_version: 0x%x\n", tls_plaintext_legacy_record_version);
-    printf("tls_plaintext_length: %u\n", tls_plaintext_length);
-    switch(tls_plaintext_type) {
-      // tls handshake
-      case 22: {
-        uint8_t tls_msg_type = buffer[index++];
-        uint32_t tls_msg_length = (buffer[index] << 16) | (buffer[index+1] << 8) | buffer[index+2]; index += 3;
-        printf("tls_msg_type: %u\n", tls_msg_type);
-        printf("tls_msg_length: %u\n", tls_msg_length);
-        switch(tls_msg_type) {
-          // client hello
-          case 1: {
-            uint16_t legacy_version = (buffer[index] << 8) | buffer[index+1]; index += 2;
-            uint8_t * random = &buffer[index]; index += 32;
-            uint8_t legacy_session_id = buffer[index++];
-            uint8_t * cipher_suites = &buffer[index]; index += 2;
-            uint8_t legacy_compression_methods = buffer[index++];
-            uint16_t extensions = (buffer[index] << 8) | buffer[index+1]; index += 2;
-            printf("legacy_version: 0x%x\n", legacy_version);
-            printf("legacy_session_id: %u\n", legacy_session_id);
-            printf("cipher_suites: %u %u\n", cipher_suites[0], cipher_suites[1]);
-            printf("legacy_compression_methods: %u\n", legacy_compression_methods);
-            printf("extensions: %u\n", extensions);
-            break; }
-        }
-        break; }
-    }
-  }
-  */
+  deadline_arm(t, "send", deadline_send_ms);
 
   // handle GET
   // get uri and query_string
@@ -403,6 +1156,8 @@ static void * thread_routine(void * vargp) {
     }
     uri[j] = '\0';
   }
+  traced_uri = uri;
+  PROBE(parse, t->thread_id, uri, client, length);
   
   char * filename = strrchr(uri, '/') + 1;
   do { uri += 1; } while(uri[0] == '/');
@@ -456,10 +1211,9 @@ static void * thread_routine(void * vargp) {
       // is username legal? (i.e. no slash allowed)
       if(strchr(cookie_username, '/')) { fprintf(stderr, "ERROR t%d AUTH illegal name %s\n", t->thread_id, cookie_username); goto auth_form; }
       // do we have a user by this name?
-      ensure_scratch_and_child_stdout_buffer(&t->child_stdout_buffer, &t->child_stdout_buffer_capacity);
-      char * tmp_buffer = t->child_stdout_buffer + HTTP_200_HEADER_LEN;
+      char * tmp_buffer = arena_alloc(&t->arena, cookie_username_len + 16);
       sprintf(tmp_buffer, "naws/users/%s.key", cookie_username);
-      if(access(tmp_buffer, R_OK)) { fprintf(stderr, "ERROR t%d AUTH user does not exist %s\n", t->thread_id, cookie_username); goto auth_form; }
+      if(!site_readable(tmp_buffer)) { fprintf(stderr, "ERROR t%d AUTH user does not exist %s\n", t->thread_id, cookie_username); goto auth_form; }
       // load user's public key
       unsigned char user_public_key[crypto_box_PUBLICKEYBYTES];
       load_file(tmp_buffer, user_public_key, crypto_box_PUBLICKEYBYTES, false);
@@ -499,38 +1253,49 @@ static void * thread_routine(void * vargp) {
     goto auth_form;
   }
   good_auth:
+  PROBE(auth, t->thread_id, uri, client, true);
 
   // verify access of local_uri
-  if(access(uri, R_OK)) {
+  if(!site_readable(uri)) {
     // double check it's not a resource from /naws/401/, allow those
-    ensure_scratch_and_child_stdout_buffer(&t->child_stdout_buffer, &t->child_stdout_buffer_capacity);
-    sprintf(t->child_stdout_buffer + HTTP_200_HEADER_LEN, "naws/401/%s", uri);
-    if(access(t->child_stdout_buffer + HTTP_200_HEADER_LEN, R_OK)) goto encountered_problem;
-    uri = t->child_stdout_buffer + HTTP_200_HEADER_LEN;
+    char * path_401 = arena_alloc(&t->arena, strlen(uri) + 10);
+    sprintf(path_401, "naws/401/%s", uri);
+    if(!site_readable(path_401)) goto encountered_problem;
+    uri = path_401;
   }
   
-  // try sending as static file
-  const uint32_t hash_djb2_ext = hash_djb2(ext);
-  if(send_static_header(client, hash_djb2_ext)) {
-    int file = open(uri, O_RDONLY); if(file == -1) { perror("open(uri)"); exit(EXIT_FAILURE); } struct stat file_stat; if(fstat(file, &file_stat)) { perror("fstat(uri)"); exit(EXIT_FAILURE); }
-    { ssize_t sent = sendfile(client, file, NULL, file_stat.st_size); if(sent != file_stat.st_size) { if(sent == -1) perror("sendfile(uri)"); else fprintf(stderr, "t%d sendfile(uri): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); close(file); goto abort_client; } }
-    if(close(file)) { perror("close(uri)"); exit(EXIT_FAILURE); }
+  // try sending as static file (a bundle knows the extension hash of its files already)
+  const struct bundle_entry * entry = bundle? bundle_find(uri) : NULL;
+  const uint32_t hash_djb2_ext = entry? entry->hash_djb2_ext : hash_djb2(ext);
+  const char * mime = static_mime(hash_djb2_ext);
+  if(mime) {
+    if(!send_static_header(client, mime, entry)) goto abort_client;
+    struct site_file file; if(!site_open(uri, &file)) { perror("open(uri)"); exit(EXIT_FAILURE); }
+    PROBE(static_start, t->thread_id, uri, client, file.size);
+    { ssize_t sent; bool complete = send_file_paced(t, &file, &sent); PROBE(static_end, t->thread_id, uri, client, sent); if(!complete) { fprintf(stderr, "t%d sendfile(uri): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); site_close(&file); goto abort_client; } }
+    if(site_close(&file)) { perror("close(uri)"); exit(EXIT_FAILURE); }
   } else {
     // if a program, fork and run
     switch(hash_djb2_ext) {
       case hash_djb2_:
         // note: I can't rely on execute permission so I don't bother testing here
-        { struct stat uri_stat; if(!stat(uri, &uri_stat) && S_ISDIR(uri_stat.st_mode)) goto encountered_problem; }
+        // (a bundle only holds files)
+        { struct stat uri_stat; if(!bundle && !stat(uri, &uri_stat) && S_ISDIR(uri_stat.st_mode)) goto encountered_problem; }
         break;
       case hash_djb2_py:
         break;
       default: goto encountered_problem;
     }
+    // the client waits on us, not the other way around
+    timer_cancel(&t->deadline);
     int pipe_err[2], pipe_out[2];
-    if(pipe(pipe_err) || pipe(pipe_out)) { perror("pipe()"); exit(EXIT_FAILURE); }
+    // close-on-exec too (the child's dup2() onto stdout/stderr clears it)
+    if(pipe2(pipe_err, O_CLOEXEC) || pipe2(pipe_out, O_CLOEXEC)) { perror("pipe2()"); exit(EXIT_FAILURE); }
     pid_t pid = fork(); 
     // child
     if(!pid) {
+      { sigset_t mask; sigemptyset(&mask); if(sigprocmask(SIG_SETMASK, &mask, NULL) == -1) { perror("CHILD sigprocmask"); exit(EXIT_FAILURE); } }
+      if(signal(SIGPIPE, SIG_DFL) == SIG_ERR) { perror("CHILD signal(SIGPIPE)"); exit(EXIT_FAILURE); }
       if(close(0)) { perror("CHILD close(0)"); exit(EXIT_FAILURE); }
       if(close(1)) { perror("CHILD close(1)"); exit(EXIT_FAILURE); }
       if(close(2)) { perror("CHILD close(2)"); exit(EXIT_FAILURE); }
@@ -546,6 +1311,8 @@ static void * thread_routine(void * vargp) {
       snprintf(query_string_env, 1024 + 13, "QUERY_STRING=%s", query_string);
       query_string_env[cap - 1] = '\0';
       char * const envp[] = { query_string_env, NULL };
+      // a bundled program has no file to run and no folder to run in
+      if(bundle) exec_bundled_program(uri, filename, hash_djb2_ext, envp, t->thread_id);
       // change working directory to be where the script resides
       filename[-1] = '\0'; if(uri != filename && chdir(uri)) { perror("CHILD chdir(path)"); fprintf(stderr, "CHILD t%d path: %s\n", t->thread_id, uri); exit(EXIT_FAILURE); }
       switch(hash_djb2_ext) {
@@ -561,19 +1328,7 @@ static void * thread_routine(void * vargp) {
             char hash_bang[1025];
             ssize_t n = read(file, hash_bang, 1024); if(n == -1) { perror("CHILD read(hash_bang)"); exit(EXIT_FAILURE); }
             if(close(file)) { perror("CHILD WARNING close(non-executable-program)"); }
-            if(n < 2) { fprintf(stderr, "CHILD t%d read(hash_bang) wasn't big enough for hash bang\n", t->thread_id); exit(EXIT_FAILURE); }
-            if(hash_bang[0] != '#' || hash_bang[1] != '!') { fprintf(stderr, "CHILD t%d not hash bang\n", t->thread_id); exit(EXIT_FAILURE); }
-            hash_bang[n] = '\0';
-            char * line_sep = &hash_bang[2];
-            char * hash_bang_line = strsep(&line_sep, "\r\n");
-            char * args[] = { NULL, NULL, NULL, NULL };
-            char * command_name = strrchr(hash_bang_line, '/');
-            if(command_name) command_name += 1; else command_name = &hash_bang[2];
-            int i = 0;
-            args[i++] = command_name;
-            if(!strcmp(command_name, "python3") || !strcmp(command_name, "python")) args[i++] = "-B";
-            args[i++] = filename;
-            execve(&hash_bang[2], args, envp);
+            exec_hash_bang(hash_bang, n, filename, envp, t->thread_id);
           }
           perror("CHILD execve()");
           break; }
@@ -587,12 +1342,14 @@ static void * thread_routine(void * vargp) {
     }
     // parent
     if(pid == -1) { perror("fork()"); exit(EXIT_FAILURE); }
+    PROBE(cgi_spawn, t->thread_id, uri, client, pid);
     struct pollfd fds[2];
     const int timeout_ms = 1000;
     fds[0].fd = pipe_out[0]; if(close(pipe_out[1])) { perror("close(pipe_out)"); exit(EXIT_FAILURE); }
     fds[1].fd = pipe_err[0]; if(close(pipe_err[1])) { perror("close(pipe_err)"); exit(EXIT_FAILURE); }
     fds[0].events = fds[1].events = POLLIN;
     bool child_has_stderr = false;
+    acquire_child_stdout_buffer(t);
     size_t child_stdout_buffer_size = HTTP_200_HEADER_LEN;
     while(true) {
       int polled = poll(fds, 2, timeout_ms); if(polled == -1) { perror("poll()"); exit(EXIT_FAILURE); }
@@ -602,15 +1359,13 @@ static void * thread_routine(void * vargp) {
         bool read_something = false;
         // buffer stdout
         if(fds[0].revents & POLLIN) {
-          ensure_scratch_and_child_stdout_buffer(&t->child_stdout_buffer, &t->child_stdout_buffer_capacity);
           size_t space_left = t->child_stdout_buffer_capacity - child_stdout_buffer_size;
           ssize_t n = read(fds[0].fd, &t->child_stdout_buffer[child_stdout_buffer_size], space_left); if(n == -1) { perror("read(child stdout)"); exit(EXIT_FAILURE); }
+          child_stdout_buffer_size += n;
           if(n == space_left) {
-            t->child_stdout_buffer_capacity *= 2;
-            t->child_stdout_buffer = realloc(t->child_stdout_buffer, t->child_stdout_buffer_capacity);
+            grow_child_stdout_buffer(t, child_stdout_buffer_size);
             printf("INFO t%d grew child stdout buffer to %zu\n", t->thread_id, t->child_stdout_buffer_capacity);
           }
-          child_stdout_buffer_size += n;
           read_something = true;
         }
         // spew stderr
@@ -626,7 +1381,9 @@ static void * thread_routine(void * vargp) {
           int wstatus;
           pid_t waited = waitpid(pid, &wstatus, WNOHANG); if(waited == -1) { perror("waitpid()"); exit(EXIT_FAILURE); }
           if(waited == pid) {
+            deadline_arm(t, "send", deadline_send_ms);
             int child_exit = WIFEXITED(wstatus)? WEXITSTATUS(wstatus) : EXIT_FAILURE;
+            PROBE(child_exit, t->thread_id, uri, client, child_exit);
             //printf("child exit: %d\n", child_exit);
             if(close(fds[0].fd)) perror("WARNING close(child stdout)");
             if(close(fds[1].fd)) perror("WARNING close(child stderr)");
@@ -636,14 +1393,13 @@ static void * thread_routine(void * vargp) {
               if(child_exit == 4) { printf("WARNING t%d child force 404\n", t->thread_id); goto encountered_problem; }
               printf("WARNING t%d child encountered problem (stderr=%d exit=%d), reply 500\n", t->thread_id, child_has_stderr, child_exit);
               { ssize_t sent = send(client, HTTP_500_HEADER, HTTP_500_HEADER_LEN, MSG_MORE); if(sent != HTTP_500_HEADER_LEN) { if(sent == -1) perror("send()"); else fprintf(stderr, "t%d send(): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); goto abort_client; } }
-              int file = open("naws/500.inc", O_RDONLY); if(file == -1) { perror("open(500.inc)"); exit(EXIT_FAILURE); } struct stat file_stat; if(fstat(file, &file_stat)) { perror("fstat(500.inc)"); exit(EXIT_FAILURE); }
-              { ssize_t sent = sendfile(client, file, NULL, file_stat.st_size); if(sent != file_stat.st_size) { if(sent == -1) perror("sendfile()"); else fprintf(stderr, "t%d sendfile(500): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); close(file); goto abort_client; } }
-              if(close(file)) { perror("close(500.inc)"); exit(EXIT_FAILURE); }
+              struct site_file file; if(!site_open("naws/500.inc", &file)) { perror("open(500.inc)"); exit(EXIT_FAILURE); }
+              { ssize_t sent = site_sendfile(client, &file); if(sent != file.size) { if(sent == -1) perror("sendfile()"); else fprintf(stderr, "t%d sendfile(500): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); site_close(&file); goto abort_client; } }
+              if(site_close(&file)) { perror("close(500.inc)"); exit(EXIT_FAILURE); }
             }
             // child program success
             else {
-              ensure_scratch_and_child_stdout_buffer(&t->child_stdout_buffer, &t->child_stdout_buffer_capacity);
-              ssize_t sent = send(client, t->child_stdout_buffer, child_stdout_buffer_size, 0); if(sent != child_stdout_buffer_size) { if(sent == -1) perror("send()"); else fprintf(stderr, "t%d send(): couldn't send whole message, sent only %zu.\n", t->thread_id, sent); goto abort_client; }
+              if(!send_paced(t, t->child_stdout_buffer, child_stdout_buffer_size)) { fprintf(stderr, "t%d send(): couldn't send whole message\n", t->thread_id); goto abort_client; }
             }
             break;
           }
@@ -654,13 +1410,14 @@ static void * thread_routine(void * vargp) {
 
   // auth form
   goto skip_auth_form; auth_form: {
+    PROBE(auth, t->thread_id, uri, client, false);
     printf("WARNING t%d require authentification\n", t->thread_id);
     // read public key (which is already in javascript Uint8Array declaration format)
-    int file = open("naws/public.key", O_RDONLY); if(file == -1) { perror("open(public.key)"); exit(EXIT_FAILURE); } struct stat file_stat; if(fstat(file, &file_stat)) { perror("fstat(public.key)"); exit(EXIT_FAILURE); }
-    char public_key[file_stat.st_size + 1];
-    public_key[file_stat.st_size] = '\0';
-    ssize_t n = read(file, public_key, file_stat.st_size); if(n != file_stat.st_size) { if(n == -1) perror("read(public.key)"); else fprintf(stderr, "t%d read(public.key): couldn't read whole key\n", t->thread_id); exit(EXIT_FAILURE); }
-    if(close(file)) { perror("close(public.key)"); exit(EXIT_FAILURE); }
+    struct site_file file; if(!site_open("naws/public.key", &file)) { perror("open(public.key)"); exit(EXIT_FAILURE); }
+    char public_key[file.size + 1];
+    public_key[file.size] = '\0';
+    ssize_t n = site_read(&file, public_key, file.size); if(n != file.size) { if(n == -1) perror("read(public.key)"); else fprintf(stderr, "t%d read(public.key): couldn't read whole key\n", t->thread_id); exit(EXIT_FAILURE); }
+    if(site_close(&file)) { perror("close(public.key)"); exit(EXIT_FAILURE); }
     // encode a server message that includes a timestamp of some sort
     uint64_t ns = get_time_ns() + random() % 1000 * UINT64_C(1000000000); // I fudge the time a bit for unpredictability
     unsigned char nonce[crypto_secretbox_NONCEBYTES];
@@ -671,8 +1428,8 @@ static void * thread_routine(void * vargp) {
     crypto_secretbox_easy(ciphertext, (const unsigned char *)&ns, sizeof(ns), nonce, server_symmetric_key);
     explicit_bzero(server_symmetric_key, crypto_secretbox_KEYBYTES);
     // convert that to javascript Uint8Array declaration format, (with nonce too)
-    ensure_scratch_and_child_stdout_buffer(&t->child_stdout_buffer, &t->child_stdout_buffer_capacity);
-    char * tmp_buffer = t->child_stdout_buffer + HTTP_200_HEADER_LEN;
+    char * server_message = arena_alloc(&t->arena, sizeof("new Uint8Array([])") + (crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES + sizeof(ns)) * sizeof(", 255"));
+    char * tmp_buffer = server_message;
     tmp_buffer += sprintf(tmp_buffer, "new Uint8Array([%d", nonce[0]);
     for(int i = 1; i < crypto_secretbox_NONCEBYTES; i++) {
       tmp_buffer += sprintf(tmp_buffer, ", %d", nonce[i]);
@@ -682,14 +1439,14 @@ static void * thread_routine(void * vargp) {
     }
     tmp_buffer += sprintf(tmp_buffer, "])");
     // send login page
-    send_static_header(client, hash_djb2_html);
-    file = open("naws/401.inc", O_RDONLY); if(file == -1) { perror("open(401.inc)"); exit(EXIT_FAILURE); }
+    if(!send_static_header(client, static_mime(hash_djb2_html), NULL)) goto abort_client;
+    if(!site_open("naws/401.inc", &file)) { perror("open(401.inc)"); exit(EXIT_FAILURE); }
     const char * from[2];
     const char * to[2];
     from[0] = "SRV_PUB"; to[0] = public_key;
-    from[1] = "SRV_MSG"; to[1] = t->child_stdout_buffer + HTTP_200_HEADER_LEN;
-    send_template_file(client, file, from, to, 2);
-    if(close(file)) { perror("close(401.inc)"); exit(EXIT_FAILURE); }
+    from[1] = "SRV_MSG"; to[1] = server_message;
+    if(!send_template_file(client, &file, from, to, 2)) { site_close(&file); goto abort_client; }
+    if(site_close(&file)) { perror("close(401.inc)"); exit(EXIT_FAILURE); }
   } skip_auth_form:
 
   // if any problem arised, do 404 instead
@@ -706,8 +1463,14 @@ static void * thread_routine(void * vargp) {
 
   printf("ACCESS t%d done handling client\n", t->thread_id);
   abort_client:
+  PROBE(close, t->thread_id, traced_uri, client, 0);
+  // the deadline still covers SSL_shutdown() (a client that stops reading can't pin the slot), but it must be gone before the fd can be reused
+  if(t->tls_client) tls_close(t);
   if(shutdown(client, SHUT_RDWR)) { perror("WARNING shutdown(client)"); }
+  timer_cancel(&t->deadline);
   if(close(client)) { perror("WARNING close(client)"); }
+  if(t->child_stdout_buffer) { pool_release(t->child_stdout_buffer, t->child_stdout_buffer_capacity); t->child_stdout_buffer = NULL; }
+  arena_reset(&t->arena);
 
   t->in_use = false;
 }